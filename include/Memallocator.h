@@ -3,21 +3,40 @@
 
 #include <vector>
 #include <map>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
 
 namespace MemPool
 {
 	namespace Private
 	{
+		class Provisioner;
+
 		//////////////////////////////////////////////////////////////////////////////////////
 		/////
 		///  Manages a dynamically allocated, fixed size slab of memory. Provides an interface
 		///  to allocate and deallocate fixed sized slots in this array. Once the slab is full
 		///  the allocation function will start returning errors to the allocation requests.
 		///
+		///  A Slab is only the hot header of the slab: Pool keeps them in a contiguous array,
+		///  two to a cache line, so searching for a slab touches no slot memory. Free slots
+		///  hold a pointer to the next free slot, so allocation is a single dependent load.
+		///  initialize() threads every slot onto the free list, which faults the slab in
+		///  where it is built, e.g. on the provisioner thread. A slab on caller owned
+		///  storage (attach) instead carves never used slots off its untouched end on
+		///  demand, so static storage costs no page faults until it is actually used.
+		///
 		///////////////////////////////////////////////////////////////////////////////////////
-		class Slab
+		class alignas(32) Slab
 		{
 		public:
+			/// Largest number of slots a slab can hold.
+			static constexpr std::size_t MAX_SLOTS = 0xffffffff;
+
 			Slab (std::size_t iNumSlots);
 
 			// Default copyconstructor
@@ -26,11 +45,13 @@ namespace MemPool
 
 			void initialize(std::size_t iSlotSize);
 
+			void attach(char *pcMemory);
+
 			void destroy();
 
 			void *allocate(std::size_t iSlotSize);
 
-			bool deallocate(void *pv, std::size_t iSlotSize);
+			bool deallocate(void *pv);
 
 			void * initialized() const { return mpcMemoryPool; }
 
@@ -38,16 +59,52 @@ namespace MemPool
 
 			std::size_t  size()  const { return miNumUsed; }
 
-			bool full() const { return miNextFree == miNumSlots?true:false; }
+			bool full() const { return miNumUsed == miNumSlots; }
 
 			std::size_t capacity() const { return miNumSlots; }
 
 		private:
-			char *mpcMemoryPool;        /// The array of slots
-			std::size_t  *maiFreeList;  /// Array based linked list of free slots.
-			long miNextFree;			/// Head of the free list.
-			std::size_t miNumSlots;      /// Number of slots.
-			std::size_t miNumUsed;       /// Number of used slots.
+			void **mppFreeHead;          /// Head of the free list of released slots.
+			char *mpcMemoryPool;         /// The array of slots
+			char *mpcUnused;             /// First slot never handed out, if attached.
+			uint32_t miNumUsed;          /// Number of used slots.
+			uint32_t miNumSlots;         /// Number of slots.
+		};
+
+		//////////////////////////////////////////////////////////////////////////////////////
+		/////
+		///  Byte budget shared by the pools of an Allocator. Pools reserve the memory of a slab
+		///  when they add it, or when they ask the provisioner for it, and it is given back once
+		///  the slab has been freed. A limit of 0 means none.
+		///
+		///  Only the thread using the allocator reserves; the provisioner may unreserve at the
+		///  same time, which only makes room, so checking available() before reserve() is safe.
+		///
+		///////////////////////////////////////////////////////////////////////////////////////
+		class Budget
+		{
+		public:
+			Budget():miReserved(0),miSoftLimit(0),miHardLimit(0),mbPressure(false){}
+
+			void setLimits(std::size_t iSoftLimit, std::size_t iHardLimit);
+
+			/// Bytes that can still be reserved before reaching the hard limit.
+			std::size_t available() const;
+
+			void reserve(std::size_t iBytes);
+
+			void unreserve(std::size_t iBytes) { miReserved.fetch_sub(iBytes, std::memory_order_relaxed); }
+
+			std::size_t reserved() const { return miReserved.load(std::memory_order_relaxed); }
+
+			/// Reports, once, that a reservation crossed the soft limit.
+			bool pressure();
+
+		private:
+			std::atomic<std::size_t> miReserved;
+			std::size_t miSoftLimit;
+			std::size_t miHardLimit;
+			bool mbPressure;
 		};
 
 		///////////////////////////////////////////////////////////////////////////////////////////
@@ -61,20 +118,25 @@ namespace MemPool
 		class Pool
 		{
 		public:
-			Pool(std::size_t iNumSlots, std::size_t iSlotSize);
+			Pool(std::size_t iNumSlots, std::size_t iSlotSize, Provisioner *pProvisioner = NULL,
+				 Budget *pBudget = NULL);
 
 			// To Check:
 			// Default constructor required for map's operator[]
 			// which inserts a mapped value using default construtor.
 			// This will not be used by the allocator, but added for compilation.
-			Pool(){}
+			Pool():mpProvisioner(NULL),mpBudget(NULL){}
 
 			~Pool();
 
 			void *allocate(std::size_t iSlotSize);
 
+			void *tryAllocate(std::size_t iSlotSize);
+
 			void deallocate (void *pv, std::size_t iSlotSize);
 
+			std::size_t trim();
+
             /// Query the size of the slot this pool manages.
             /// return: Size of the slot managed by the pool.
 			std::size_t slotSize() const { return miSlotSize ; }
@@ -90,12 +152,79 @@ namespace MemPool
 			//Garbage collection logic.
 			void shrink();
 
+			Slab *grow(std::size_t iSlotSize);
+
+			void watch(const Slab &slab, std::size_t iSlotSize);
+
+			void release(Slab &slab);
+
 			typedef std::vector<Slab> SlabTable;
 			SlabTable maSlabs;
 			long miLastAllocate;
 			long miLastDeallocate;
 			std::size_t miNumSlots;
 			std::size_t miSlotSize;
+			Provisioner *mpProvisioner;   /// Background slab builder, NULL if disabled.
+			bool mbSpareRequested;        /// A spare slab has been asked for and not yet used.
+			Budget *mpBudget;             /// Byte budget of the allocator, NULL if none.
+		};
+
+		//////////////////////////////////////////////////////////////////////////////////////
+		/////
+		///  Maintenance thread of an Allocator. Builds spare slabs for pools that are running
+		///  out of room, so the allocation that triggers growth only has to pick one up, and
+		///  destroys slabs that pools have released. Pools talk to it only through request(),
+		///  take() and retire(); the slabs themselves are never shared.
+		///
+		///  The bytes of a slab stay reserved in the budget while the provisioner holds it: a
+		///  spare is reserved by its pool when requested and charged to the pool once taken,
+		///  and the provisioner unreserves whatever it drops or destroys.
+		///
+		///////////////////////////////////////////////////////////////////////////////////////
+		class Provisioner
+		{
+		public:
+			Provisioner(Budget *pBudget);
+
+			~Provisioner();
+
+			void request(const Pool *pPool, std::size_t iNumSlots, std::size_t iSlotSize);
+
+			bool take(const Pool *pPool, Slab &slab);
+
+			void retire(const Slab &slab, std::size_t iSlotSize);
+
+		private:
+			Provisioner(const Provisioner &rhs);
+
+			Provisioner &operator=(const Provisioner &rhs);
+
+			void run();
+
+			void discard(Slab &slab, std::size_t iSlotSize);
+
+			struct Request
+			{
+				const Pool *mpPool;
+				std::size_t miNumSlots;
+				std::size_t miSlotSize;
+			};
+
+			std::mutex mMutex;
+			std::condition_variable mWakeup;
+			bool mbStop;
+			std::vector<Request> maRequests;             /// Slabs to build.
+			/// A slab and the slot size its bytes were reserved for.
+			struct Held
+			{
+				Slab mSlab;
+				std::size_t miSlotSize;
+			};
+
+			Budget *mpBudget;                            /// Budget the slabs are charged to, or NULL.
+			std::map<const Pool *, Held> maReady;        /// Built slabs waiting for their pool.
+			std::vector<Held> maRetired;                 /// Slabs to destroy.
+			std::thread mThread;                         /// Started last, after the state above.
 		};
 	}
 
@@ -117,24 +246,80 @@ namespace MemPool
 
 	public:
 		static const std::size_t DEFAULT_NUM_SLOTS = 1024;
-		Allocator( std::size_t iNumSlots = DEFAULT_NUM_SLOTS):miNumSlots(iNumSlots){}
-		
+
+		/// Called when the memory reserved by the allocator crosses its soft limit.
+		typedef void (*PressureHandler)(Allocator &allocator, void *pvContext);
+
+		/// With bBackground set, a maintenance thread builds the next slab of a pool
+		/// before the current ones fill up, and frees released slabs asynchronously.
+		Allocator( std::size_t iNumSlots = DEFAULT_NUM_SLOTS, bool bBackground = false);
+
+		/// Serve objects of iStaticSlotSize bytes from pcStaticStorage, which holds iNumSlots
+		/// slots of adjust(iStaticSlotSize) bytes, before creating a pool. Used by
+		/// StaticPooledObject for its static first slab.
+		Allocator( std::size_t iNumSlots, char *pcStaticStorage, std::size_t iStaticSlotSize);
 
 		// Destruct an allocator.
-		~Allocator(){}
+		~Allocator();
 
 		void *allocate(std::size_t iSlotSize);
 
+		/// As allocate, but returns NULL instead of throwing when the hard limit
+		/// is reached or memory is exhausted.
+		void *tryAllocate(std::size_t iSlotSize);
+
 		void deallocate (void *pv, std::size_t iSlotSize);
 
-		static std::size_t adjust(std::size_t iSlotSize);
+		/// Round a requested size up to the slot size of its pool. Objects of similar size
+		/// share a pool; slots are multiples of the pointer size since free slots hold the
+		/// pointer to the next one.
+		static constexpr std::size_t adjust(std::size_t iSlotSize)
+		{
+			return iSlotSize < sizeof(void *) ? sizeof(void *)
+				: (iSlotSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+		}
+
+		/// Limit the bytes held in slabs. Crossing iSoftLimit calls the pressure
+		/// handler and trims; nothing is reserved past iHardLimit. 0 means no limit.
+		void setBudget(std::size_t iSoftLimit, std::size_t iHardLimit);
+
+		void setPressureHandler(PressureHandler pfnHandler, void *pvContext);
+
+		/// Bytes currently held in slabs, including spares being built and
+		/// released slabs not yet freed by the maintenance thread.
+		std::size_t reserved() const { return mBudget.reserved(); }
+
+		/// Release every empty slab. Returns the number of bytes released.
+		std::size_t trim();
 
 	private:
+		Private::Pool *findPool(std::size_t iSlotSize);
+
+		Private::Pool *createPool(std::size_t iSlotSize);
+
+		void relieve();
+
 		typedef std::map<std::size_t, Private::Pool> PoolMap;
 
 		PoolMap maPoolMap;
 
 		std::size_t miNumSlots;
+
+		// One entry lookup cache. Callers with a fixed object size (e.g.
+		// coroutine frames) hit it every time and skip the map search.
+		std::size_t miLastSlotSize;
+		Private::Pool *mpLastPool;
+
+		Private::Provisioner *mpProvisioner;
+
+		Private::Budget mBudget;
+		PressureHandler mpfnPressureHandler;
+		void *mpvPressureContext;
+
+		// Slab on caller owned storage, used before the pool of its size.
+		// miStaticSlotSize is 0, which no adjusted size matches, if unused.
+		Private::Slab mStaticSlab;
+		std::size_t miStaticSlotSize;
 	};
 
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -149,6 +334,8 @@ namespace MemPool
 	template <std::size_t iNumSlots = Allocator::DEFAULT_NUM_SLOTS>
 	class PooledObject
 	{
+		static_assert(iNumSlots <= Private::Slab::MAX_SLOTS, "iNumSlots exceeds Slab::MAX_SLOTS");
+
 	public:
 		static void *operator new(std::size_t iSize)
 		{
@@ -171,5 +358,317 @@ namespace MemPool
 		static Allocator gAllocator(iNumSlots);
 		return gAllocator;
 	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	///////////
+	///
+	/// As PooledObject, but the first iNumSlots objects of the derived class come from zero initialized static
+	/// storage sized from sizeof(Derived), so early allocations do not touch the heap. Further objects, and
+	/// objects of classes derived from Derived with a different size, use the usual pools. There is one
+	/// allocator per Derived.
+	///
+	/// Usage:
+	///     class Node : public MemPool::StaticPooledObject<Node, 1024> { ... };
+	///
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	template <class Derived, std::size_t iNumSlots = Allocator::DEFAULT_NUM_SLOTS>
+	class StaticPooledObject
+	{
+		static_assert(iNumSlots <= Private::Slab::MAX_SLOTS, "iNumSlots exceeds Slab::MAX_SLOTS");
+
+	public:
+		static void *operator new(std::size_t iSize)
+		{
+			return instance().allocate(iSize);
+		}
+		static void operator delete(void *pv, std::size_t  iSize)
+		{
+			instance().deallocate(pv, iSize);
+		}
+
+		static Allocator &instance();
+
+		virtual ~StaticPooledObject(){}
+	};
+
+	template <class Derived, std::size_t iNumSlots>
+	Allocator & StaticPooledObject<Derived, iNumSlots>::instance()
+	{
+		// Derived is complete here: this is only instantiated by its new and delete.
+		alignas(16) static char gacStorage[iNumSlots * Allocator::adjust(sizeof(Derived))];
+		static Allocator gAllocator(iNumSlots, gacStorage, sizeof(Derived));
+		return gAllocator;
+	}
+
+	namespace Private
+	{
+		//////////////////////////////////////////////////////////////////////////////////////
+		/////
+		///  Per thread heap of coroutine frames. Frames are carved out of an Allocator owned
+		///  by the creating thread and are prefixed by a small header recording the owning
+		///  heap and the frame size. A frame freed on the owning thread goes straight back
+		///  to its pool; a frame freed on any other thread is pushed onto a lock free list
+		///  which the owner drains on its next allocation.
+		///
+		///  The owning thread and every live frame each hold a reference to the heap. When
+		///  the thread exits it drops its reference, and whoever drops the last one, the
+		///  thread or the free of its last frame, deletes the heap with all its slabs.
+		///
+		///////////////////////////////////////////////////////////////////////////////////////
+		class FrameHeap
+		{
+		public:
+			/// Size reserved in front of every frame. Keeps frames 16 byte aligned.
+			static const std::size_t HEADER_SIZE = 16;
+
+			FrameHeap(std::size_t iNumSlots);
+
+			void *allocate(std::size_t iSize);
+
+			static void deallocate(void *pv, FrameHeap *pLocal);
+
+			void release();
+
+		private:
+			FrameHeap(const FrameHeap &rhs);
+
+			FrameHeap &operator=(const FrameHeap &rhs);
+
+			~FrameHeap(){}
+
+			void drain();
+
+			struct FrameHeader
+			{
+				union
+				{
+					FrameHeap *mpOwner;     /// Heap the frame belongs to, while live.
+					FrameHeader *mpNext;    /// Next frame on the remote free list.
+				};
+				std::size_t miSize;         /// Slot size the frame was allocated with.
+			};
+
+			void unreference();
+
+			Allocator maAllocator;
+			std::atomic<FrameHeader *> mpRemoteFree;  /// Frames freed by other threads.
+			std::atomic<std::size_t> miNumRefs;       /// Live frames, plus one while the owner runs.
+		};
+
+		///////////////////////////////////////////////////////////////////////////////////////
+		///
+		///  Owns the FrameHeap of one thread and releases it when the thread exits. While it
+		///  lives, *ppLocal points to the heap; it is reset before the heap is released, so
+		///  frames freed later in thread shutdown take the remote path.
+		///
+		///////////////////////////////////////////////////////////////////////////////////////
+		class FrameHeapHandle
+		{
+		public:
+			FrameHeapHandle(std::size_t iNumSlots, FrameHeap **ppLocal):mpHeap(new FrameHeap(iNumSlots)),
+				mppLocal(ppLocal)
+			{
+				*mppLocal = mpHeap;
+			}
+
+			~FrameHeapHandle()
+			{
+				*mppLocal = NULL;
+				mpHeap->release();
+			}
+
+		private:
+			FrameHeapHandle(const FrameHeapHandle &rhs);
+
+			FrameHeapHandle &operator=(const FrameHeapHandle &rhs);
+
+			FrameHeap *mpHeap;
+			FrameHeap **mppLocal;
+		};
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	///////////
+	///
+	/// Base class for coroutine promise types whose frames should come from the pool. Every coroutine type has
+	/// a fixed frame size, so each one ends up with a dedicated size class. Each thread allocates from its own
+	/// heap; frames destroyed on the creating thread take the fast path, frames destroyed elsewhere are handed
+	/// back to the creating thread. If a thread exits with frames still alive its heap is freed with the last one.
+	///
+	/// Usage:
+	///     struct task::promise_type : MemPool::PooledPromise<> { ... };
+	///
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	template <std::size_t iNumSlots = Allocator::DEFAULT_NUM_SLOTS>
+	class PooledPromise
+	{
+	public:
+		static void *operator new(std::size_t iSize)
+		{
+			return local()->allocate(iSize);
+		}
+		static void operator delete(void *pv, std::size_t /*iSize*/)
+		{
+			// Only compare against this thread's heap, never create one here.
+			Private::FrameHeap::deallocate(pv, gpLocal);
+		}
+
+	private:
+		static Private::FrameHeap *local();
+
+		static thread_local Private::FrameHeap *gpLocal;   /// Heap of this thread, NULL if none.
+	};
+
+	template <std::size_t iNumSlots>
+	thread_local Private::FrameHeap *PooledPromise<iNumSlots>::gpLocal = NULL;
+
+	template <std::size_t iNumSlots>
+	Private::FrameHeap * PooledPromise<iNumSlots>::local()
+	{
+		if ( gpLocal == NULL )
+		{
+			static thread_local Private::FrameHeapHandle gHeap(iNumSlots, &gpLocal);
+		}
+		return gpLocal;
+	}
+
+	namespace Private
+	{
+		//////////////////////////////////////////////////////////////////////////////////////
+		/////
+		///  Epoch based reclamation. Readers pin the global epoch while they may be holding
+		///  pointers to shared objects; retired objects go on a limbo list of the retiring
+		///  thread tagged with the epoch, and are deleted in batches by that thread once the
+		///  epoch has advanced twice, i.e. once no reader can still see them. The epoch can
+		///  only advance when every pinned thread has observed the current one.
+		///
+		///  Deletes normally run on the thread that retired the object, the same thread that
+		///  would have called delete directly. The exception is lists left behind by exiting
+		///  threads: those are deleted by whichever thread collects next. Objects whose
+		///  operator delete is not safe on any thread (a PooledObject allocator is not locked)
+		///  must therefore be flushed with flush() before their thread exits. collect() is
+		///  not enough: it leaves behind whatever a pinned reader might still see.
+		///
+		///////////////////////////////////////////////////////////////////////////////////////
+		class EpochDomain
+		{
+		public:
+			typedef void (*Deleter)(void *pv);
+
+			/// Number of retires between two collection attempts.
+			static const std::size_t COLLECT_THRESHOLD = 64;
+
+			static EpochDomain &instance();
+
+			void enter();
+
+			void leave();
+
+			void retire(void *pv, Deleter pfnDelete);
+
+			void collect();
+
+			void flush();
+
+		private:
+			struct Retired
+			{
+				void *mpv;
+				Deleter mpfnDelete;
+				uint64_t miEpoch;        /// Global epoch when the object was retired.
+			};
+
+			typedef std::deque<Retired> LimboList;
+
+			struct ThreadRecord
+			{
+				std::atomic<uint64_t> miState;      /// Pinned epoch << 1 | 1, or 0 if not pinned.
+				std::atomic<bool> mbInUse;          /// Owned by a live thread.
+				ThreadRecord *mpNext;               /// Records are never freed, only reused.
+				std::size_t miDepth;                /// Nesting of enter() calls.
+				std::size_t miSinceCollect;         /// Retires since the last collect().
+				LimboList maLimbo;
+			};
+
+			class RecordHandle
+			{
+			public:
+				RecordHandle():mpRecord(NULL){}
+
+				~RecordHandle();
+
+				ThreadRecord *mpRecord;
+			};
+
+			EpochDomain();
+
+			EpochDomain(const EpochDomain &rhs);
+
+			EpochDomain &operator=(const EpochDomain &rhs);
+
+			ThreadRecord *local();
+
+			bool tryAdvance();
+
+			static void reclaim(LimboList &limbo, uint64_t iEpoch);
+
+			std::atomic<uint64_t> miEpoch;
+			std::atomic<ThreadRecord *> mpRecords;
+			std::mutex mOrphanMutex;
+			LimboList maOrphans;                    /// Left behind by exited threads.
+		};
+
+		template <class T>
+		void deleteRetired(void *pv)
+		{
+			delete static_cast<T *>(pv);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	///////////
+	///
+	/// Pins the current epoch for the lifetime of the guard. Readers of a shared structure hold one while
+	/// traversing it; objects retired meanwhile are not deleted until every such guard has been released.
+	///
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	class EpochGuard
+	{
+	public:
+		EpochGuard() { Private::EpochDomain::instance().enter(); }
+
+		~EpochGuard() { Private::EpochDomain::instance().leave(); }
+
+	private:
+		EpochGuard(const EpochGuard &rhs);
+
+		EpochGuard &operator=(const EpochGuard &rhs);
+	};
+
+	/// Delete pObject once no EpochGuard that might still see it is alive. For a PooledObject the
+	/// slot goes back to its pool through the usual operator delete, in batches.
+	template <class T>
+	void retire(T *pObject)
+	{
+		Private::EpochDomain::instance().retire(pObject, &Private::deleteRetired<T>);
+	}
+
+	/// Delete everything the calling thread has retired that no EpochGuard can still see.
+	/// Retired objects are otherwise only collected every COLLECT_THRESHOLD retires.
+	inline void collect()
+	{
+		Private::EpochDomain::instance().collect();
+	}
+
+	/// Delete everything the calling thread has retired, waiting for the EpochGuards that might still
+	/// see it to be released. Call it before a thread exits if its objects must be deleted on it. Throws
+	/// std::logic_error if the calling thread holds an EpochGuard, which would wait forever.
+	inline void flush()
+	{
+		Private::EpochDomain::instance().flush();
+	}
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef SharedPool_h
+#define SharedPool_h
+
+#include <cstddef>
+#include <stdint.h>
+#include <atomic>
+
+namespace MemPool
+{
+	//////////////////////////////////////////////////////////////////////////////////////
+	/////
+	///  Fixed size slab of slots living in a POSIX shared memory object, so that several
+	///  processes mapping the same name can allocate and free slots in place. A producer
+	///  allocates a message, fills it and passes its offset() to a consumer, which maps
+	///  it back with address() and deallocates it after reading; nothing is copied.
+	///
+	///  The free list is index based, unlike Slab's pointer list, since each process maps
+	///  the region at a different address. The head carries a tag that is bumped on every
+	///  update, so allocate/deallocate are lock free and safe against ABA across processes.
+	///
+	///  The region does not grow: allocate throws bad_alloc once all slots are in use.
+	///  It cannot be copied as assignment operator and copy constructor are private.
+	///
+	///////////////////////////////////////////////////////////////////////////////////////
+	class SharedPool
+	{
+	public:
+		/// Create and initialize a new shared memory object. Fails if it already exists.
+		SharedPool(const char *pcName, std::size_t iNumSlots, std::size_t iSlotSize);
+
+		/// Attach to a shared memory object created by another process.
+		explicit SharedPool(const char *pcName);
+
+		/// Unmaps the region. The shared memory object itself persists until unlink().
+		~SharedPool();
+
+		void *allocate();
+
+		bool deallocate(void *pv);
+
+		/// Process independent handle for a slot.
+		std::size_t offset(const void *pv) const;
+
+		/// Map a handle from offset() back to an address in this process.
+		void *address(std::size_t iOffset) const;
+
+		std::size_t slotSize() const;
+
+		std::size_t capacity() const;
+
+		std::size_t size() const;
+
+		bool empty() const { return size() == 0; }
+
+		bool full() const { return size() == capacity(); }
+
+		/// Remove the shared memory object name. Mappings stay valid until released.
+		static void unlink(const char *pcName);
+
+	private:
+		SharedPool(const SharedPool &rhs);
+
+		SharedPool &operator=(const SharedPool &rhs);
+
+		struct Header;
+
+		void map(int iFd, std::size_t iLength);
+
+		char *slot(uint32_t iIndex) const;
+
+		Header *mpHeader;         /// Start of the mapped region.
+		char *mpcSlots;           /// First slot, just after the header.
+		std::size_t miLength;     /// Length of the mapping.
+	};
+}
+#endif
@@ -5,23 +5,40 @@
 #include "MemPoolallocator.h"
 #include <iostream>
 #include <algorithm>
+#include <limits>
+#include <stdexcept>
 #include <conio.h>
 
 
+// Hint the cache to fetch the slot the next allocation will pop.
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define MEMPOOL_PREFETCH(p) _mm_prefetch(reinterpret_cast<const char *>(p), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define MEMPOOL_PREFETCH(p) __builtin_prefetch((p), 1)
+#else
+#define MEMPOOL_PREFETCH(p)
+#endif
+
+
 /// //////////////////////////////////////////////////////////////////
 ///Slab Constructor
 //////////////////////////////////////////////////////////////////
-MemPool::Private::Slab::Slab(std::size_t iNumSlots):miNumSlots(iNumSlots){}
+MemPool::Private::Slab::Slab(std::size_t iNumSlots):mppFreeHead(NULL),mpcMemoryPool(NULL),
+				   mpcUnused(NULL),miNumUsed(0),miNumSlots(static_cast<uint32_t>(std::min(iNumSlots, MAX_SLOTS))){}
 
 
 ////////////////////////////////////////////////////////////////////////
 //
 // FUNCTION NAME: initialize
-// Initializes the Slab internal memory pool.
+// Initializes the Slab internal memory pool. Every slot is put on the
+// free list now, so the pages are touched by the thread building the
+// slab rather than by the allocations using it.
 //
 // ARGUMENTS AND RETURN INFO:
 //  IN
-//    iSlotSize: Size of each slot in the pool.
+//    iSlotSize: Size of each slot in the pool. Must be a multiple of
+//               the pointer size (see Allocator::adjust).
 //  OUT
 //    None
 //
@@ -32,30 +49,49 @@ MemPool::Private::Slab::Slab(std::size_t iNumSlots):miNumSlots(iNumSlots){}
 
 void MemPool::Private::Slab::initialize(std::size_t iSlotSize)
 {
-	try
-	{
-		mpcMemoryPool = new char[miNumSlots * iSlotSize];
-        memset(mpcMemoryPool, 0, iSlotSize * miNumSlots);
+	std::size_t iSize = static_cast<std::size_t>(miNumSlots) * iSlotSize;
 
-		maiFreeList = reinterpret_cast<std::size_t *>(mpcMemoryPool);
-	}
-	catch (std::bad_alloc &exep)
-	{
-		delete [] mpcMemoryPool;
-		mpcMemoryPool = NULL;
-		//delete [] maiFreeList;
-		throw;
-	}
+	attach(new char[iSize]);
+
+	if ( miNumSlots == 0 )
+		return;
 
-	// Set the free list.
-	for ( std::size_t index = 0; index <= miNumSlots - 1; index++ )
+	// Set the free list. Each free slot points to the next one.
+	char *pcSlot = mpcMemoryPool;
+	for ( std::size_t index = 0; index < miNumSlots - 1; index++, pcSlot += iSlotSize )
 	{
-		maiFreeList[index * (iSlotSize/sizeof(std::size_t))] = index + 1;
+		*reinterpret_cast<void **>(pcSlot) = pcSlot + iSlotSize;
 	}
+	*reinterpret_cast<void **>(pcSlot) = NULL;
+
+	mppFreeHead = reinterpret_cast<void **>(mpcMemoryPool);
+	mpcUnused = mpcMemoryPool + iSize;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: attach
+// Use memory owned by the caller as the slab. It must hold capacity()
+// slots and outlive the slab; destroy() must not be called. Slots are
+// carved from it as they are first needed.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    pcMemory: Storage for the slots, aligned for any slot.
+//  OUT
+//    None
+//
+//  RETURN
+//    None.
+//
+////////////////////////////////////////////////////////////////////////
 
-	//maiFreeList[miNumSlots - 1] = -1;
+void MemPool::Private::Slab::attach(char *pcMemory)
+{
+	mpcMemoryPool = pcMemory;
+	mpcUnused = pcMemory;
+	mppFreeHead = NULL;
 	miNumUsed = 0;
-	miNextFree = 0;
 }
 
 
@@ -78,24 +114,28 @@ void MemPool::Private::Slab::initialize(std::size_t iSlotSize)
 //
 void *MemPool::Private::Slab::allocate(std::size_t iSlotSize)
 {
-	// Return NULL so that higher level code may decide
-	// the next action.
-	if ( miNumUsed == miNumSlots )
-		return NULL;
-
-	miNumUsed++;
+	void **ppSlot = mppFreeHead;
 
-	int iPreviousFreeSlotNum = miNextFree;
-
-	miNextFree = maiFreeList[iPreviousFreeSlotNum * (iSlotSize/sizeof(std::size_t))];
-
-	//miNextFree = maiFreeList[iPreviousFreeSlotNum];
+	if ( ppSlot != NULL )
+	{
+		mppFreeHead = static_cast<void **>(*ppSlot);
+		MEMPOOL_PREFETCH(mppFreeHead);
+	}
+	else
+	{
+		// Return NULL so that higher level code may decide
+		// the next action.
+		if ( miNumUsed == miNumSlots )
+			return NULL;
+
+		// No released slot to reuse, carve the next untouched one.
+		ppSlot = reinterpret_cast<void **>(mpcUnused);
+		mpcUnused += iSlotSize;
+	}
 
-	// If slab is full, set miNextFree as the end of list.
-	if ( miNumUsed == miNumSlots )
-		miNextFree = miNumSlots;
+	miNumUsed++;
 
-	return static_cast<void *>(mpcMemoryPool + (iPreviousFreeSlotNum) * iSlotSize);
+	return ppSlot;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -105,8 +145,7 @@ void *MemPool::Private::Slab::allocate(std::size_t iSlotSize)
 //
 // ARGUMENTS AND RETURN INFO:
 //  IN
-//    pv       : Pointer to slot to deallocate.
-//    iSlotSize: Size of the slot to allocate
+//    pv: Pointer to slot to deallocate.
 //  OUT
 //    None
 //
@@ -115,32 +154,19 @@ void *MemPool::Private::Slab::allocate(std::size_t iSlotSize)
 //
 ////////////////////////////////////////////////////////////////////////
 
-bool MemPool::Private::Slab::deallocate(void *pv, std::size_t iSlotSize)
+bool MemPool::Private::Slab::deallocate(void *pv)
 {
-	unsigned char *toRelease = reinterpret_cast<unsigned char *>(pv);
-	unsigned char *ptr = reinterpret_cast<unsigned char *>(mpcMemoryPool);
-	// Find which Slot in the slab is getting freed.
-	std::size_t iNumSlot = (toRelease - ptr)/iSlotSize;
+	char *pcSlot = static_cast<char *>(pv);
 
-	if ( pv < mpcMemoryPool ||  iNumSlot > miNumSlots )
+	if ( pcSlot < mpcMemoryPool || pcSlot >= mpcUnused )
 		return false;
 
 	miNumUsed--;
 
-	
-	// Changing the free slot.
-	//If the slab was full before this allocation, set the list accordingly.
-	if ( miNextFree == miNumSlots )
-	{
-		maiFreeList[iNumSlot * ((iSlotSize)/sizeof(std::size_t))] = miNextFree;
-		miNextFree = iNumSlot;
-	}
 	// Add the free slot on the front of the list.
-	else
-	{
-		maiFreeList[iNumSlot * ((iSlotSize)/sizeof(std::size_t))] = miNextFree;
-		miNextFree = iNumSlot;
-	}
+	void **ppSlot = static_cast<void **>(pv);
+	*ppSlot = mppFreeHead;
+	mppFreeHead = ppSlot;
 
 	return true;
 }
@@ -166,13 +192,14 @@ void MemPool::Private::Slab::destroy()
 {
 	delete [] mpcMemoryPool;
 	mpcMemoryPool = NULL;
-	maiFreeList = NULL;
+	mpcUnused = NULL;
+	mppFreeHead = NULL;
 }
 
 ////////////////////////////////////////////////////////////////////////
 //
 // FUNCTION NAME: allocate
-// Request a block of memory from the Slab.
+// Request a block of memory from the Pool.
 //
 // ARGUMENTS AND RETURN INFO:
 //  IN
@@ -181,10 +208,37 @@ void MemPool::Private::Slab::destroy()
 //    None
 //
 //  RETURN
-//    Memory from the slab or NULL.
+//    Memory from the pool. Throws bad_alloc if there is none.
 //
 ////////////////////////////////////////////////////////////////////////
 void *MemPool::Private::Pool::allocate(std::size_t iSlotSize)
+{
+	void *pv = tryAllocate(iSlotSize);
+
+    // If the allocation request was not succesful, throw bad_alloc.
+	if ( pv == NULL )
+	{
+		throw std::bad_alloc();
+	}
+	return pv;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: tryAllocate
+// Request a block of memory from the Pool, growing it if needed.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    iSlotSize: Size of the slot to allocate
+//  OUT
+//    None
+//
+//  RETURN
+//    Memory from the pool, or NULL if the pool could not grow.
+//
+////////////////////////////////////////////////////////////////////////
+void *MemPool::Private::Pool::tryAllocate(std::size_t iSlotSize)
 {
 	void *pv = NULL;
 	Slab *pSlab;
@@ -192,15 +246,13 @@ void *MemPool::Private::Pool::allocate(std::size_t iSlotSize)
 	// If no Slabs are allocated, push a new slab;
 	if ( maSlabs.size() == 0  )
 	{
-		maSlabs.push_back(Slab(miNumSlots));
-
-		Slab &slab = maSlabs.back();
-
-		slab.initialize(iSlotSize);
+		pSlab = grow(iSlotSize);
+		if ( pSlab == NULL )
+			return NULL;
 
 		miLastAllocate = 0;
 
-		pv = slab.allocate(iSlotSize);
+		pv = pSlab->allocate(iSlotSize);
 
 	}
 	//Find a free slab. The most likely location could be
@@ -220,15 +272,9 @@ void *MemPool::Private::Pool::allocate(std::size_t iSlotSize)
 		{
 			if ( iter == maSlabs.end() )
 			{
-				// Get the number of slots in the previous slab
-				pSlab = &maSlabs.back();
-
-				miNumSlots = miNumSlots * 2;
-				maSlabs.push_back(Slab(miNumSlots));
-
-				pSlab = &maSlabs.back();
-
-				pSlab->initialize(iSlotSize);
+				pSlab = grow(iSlotSize);
+				if ( pSlab == NULL )
+					return NULL;
 
 				pv = pSlab->allocate(iSlotSize);
 
@@ -240,27 +286,236 @@ void *MemPool::Private::Pool::allocate(std::size_t iSlotSize)
 			{
 				miLastAllocate = index;
 
-				pv = iter->allocate(iSlotSize);
+				pSlab = &*iter;
+				pv = pSlab->allocate(iSlotSize);
 				break;
 			}
 		}
 	}
 
-    // If the allocation request was not succesful, throw bad_alloc.
-	if ( pv == NULL )
+	if ( mpProvisioner != NULL )
+		watch(*pSlab, iSlotSize);
+
+	return pv;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: grow
+// Append a slab to the pool. The first slab has the configured number
+// of slots, every later one twice as many as the last. A spare built
+// by the provisioner is used when there is one; its bytes were already
+// reserved when it was requested. Otherwise the slab is cut down to
+// what is left near the hard limit of the budget.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    iSlotSize: Size of the slots in the pool.
+//  OUT
+//    None
+//
+//  RETURN
+//    The new slab, ready for allocation, or NULL if the budget or the
+//    system has no memory for it.
+//
+////////////////////////////////////////////////////////////////////////
+MemPool::Private::Slab *MemPool::Private::Pool::grow(std::size_t iSlotSize)
+{
+	std::size_t iNumSlots = std::min(maSlabs.empty() ? miNumSlots : miNumSlots * 2, Slab::MAX_SLOTS);
+	std::size_t iNominal = iNumSlots;
+	Slab slab(iNumSlots);
+	bool bReserved = false;
+
+	if ( mpProvisioner != NULL )
 	{
-		throw std::bad_alloc();
+		// Ask afresh after every growth, whether or not a spare was ready.
+		// A failed build is never reported back, and a spare arriving late
+		// is kept for the next growth (the provisioner drops duplicates).
+		mbSpareRequested = false;
+
+		bReserved = mpProvisioner->take(this, slab);
 	}
-	return pv;
+
+	if ( slab.initialized() == NULL )
+	{
+		std::size_t iAvailable = mpBudget != NULL ? mpBudget->available() : std::numeric_limits<std::size_t>::max();
+
+		if ( iNumSlots * iSlotSize > iAvailable )
+		{
+			iNumSlots = iAvailable / iSlotSize;
+			if ( iNumSlots == 0 )
+				return NULL;
+
+			slab = Slab(iNumSlots);
+		}
+
+		try
+		{
+			slab.initialize(iSlotSize);
+		}
+		catch (std::bad_alloc &)
+		{
+			return NULL;
+		}
+	}
+
+	try
+	{
+		maSlabs.push_back(slab);
+	}
+	catch (std::bad_alloc &)
+	{
+		if ( bReserved )
+			mpProvisioner->retire(slab, iSlotSize);
+		else
+			slab.destroy();
+		return NULL;
+	}
+
+	if ( mpBudget != NULL && !bReserved )
+		mpBudget->reserve(slab.capacity() * iSlotSize);
+
+	// A slab cut down to fit the budget must not set the size later
+	// slabs grow from.
+	miNumSlots = std::max(slab.capacity(), iNominal);
+
+	return &maSlabs.back();
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: watch
+// Ask the provisioner for the next slab once the newest slab is three
+// quarters full, so that it is ready before the pool has to grow. The
+// spare is reserved in the budget now, so that the spares of several
+// pools cannot together go past the hard limit.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    slab     : Slab the last allocation came from.
+//    iSlotSize: Size of the slots in the pool.
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+void MemPool::Private::Pool::watch(const Slab &slab, std::size_t iSlotSize)
+{
+	if ( mbSpareRequested || &slab != &maSlabs.back() )
+		return;
+
+	if ( slab.size() < slab.capacity() - slab.capacity() / 4 )
+		return;
+
+	// No point building a slab the budget will not take.
+	std::size_t iNumSlots = std::min(miNumSlots * 2, Slab::MAX_SLOTS);
+
+	if ( mpBudget != NULL )
+	{
+		if ( iNumSlots * iSlotSize > mpBudget->available() )
+			return;
+
+		mpBudget->reserve(iNumSlots * iSlotSize);
+	}
+
+	// Best effort: allocation must not fail because a spare could not be queued.
+	try
+	{
+		mpProvisioner->request(this, iNumSlots, iSlotSize);
+		mbSpareRequested = true;
+	}
+	catch (std::exception &)
+	{
+		if ( mpBudget != NULL )
+			mpBudget->unreserve(iNumSlots * iSlotSize);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: release
+// Free the memory of a slab which is being removed from the pool,
+// deferring it to the provisioner when there is one. Its bytes stay
+// reserved until it has actually been freed.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    slab: Slab to release.
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+void MemPool::Private::Pool::release(Slab &slab)
+{
+	if ( mpProvisioner != NULL )
+	{
+		mpProvisioner->retire(slab, miSlotSize);
+		return;
+	}
+
+	slab.destroy();
+
+	if ( mpBudget != NULL )
+		mpBudget->unreserve(slab.capacity() * miSlotSize);
 }
 
 ////////////////////////////////////////////////////////////////////////
 // Pool class Constructor/Destructor Definitions
 ////////////////////////////////////////////////////////////////////////
-MemPool::Private::Pool::Pool(std::size_t iNumSlots, std::size_t iSlotSize):miNumSlots(iNumSlots),
-				   miSlotSize(iSlotSize),miLastAllocate(-1),miLastDeallocate(-1)
+MemPool::Private::Pool::Pool(std::size_t iNumSlots, std::size_t iSlotSize, Provisioner *pProvisioner,
+				   Budget *pBudget):miNumSlots(iNumSlots),miSlotSize(iSlotSize),miLastAllocate(-1),
+				   miLastDeallocate(-1),mpProvisioner(pProvisioner),mbSpareRequested(false),mpBudget(pBudget)
+{
+
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: trim
+// Release every empty slab, not just the ones shrink() would.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    Number of bytes released.
+//
+////////////////////////////////////////////////////////////////////////
+std::size_t MemPool::Private::Pool::trim()
 {
+	std::size_t iReleased = 0;
+
+	SlabTable::iterator keep = maSlabs.begin();
+	SlabTable::iterator iter = maSlabs.begin();
+
+	for ( ; iter != maSlabs.end(); ++iter )
+	{
+		if ( iter->empty() )
+		{
+			iReleased += iter->capacity() * miSlotSize;
+			release(*iter);
+		}
+		else
+		{
+			*keep++ = *iter;
+		}
+	}
 
+	maSlabs.erase(keep, maSlabs.end());
+
+	// Indices may no longer be valid.
+	miLastAllocate = -1;
+	miLastDeallocate = -1;
+
+	return iReleased;
 }
 
 MemPool::Private::Pool::~Pool()
@@ -282,7 +537,7 @@ MemPool::Private::Pool::~Pool()
 // ARGUMENTS AND RETURN INFO:
 //  IN
 //    pv       : Pointer to slot to deallocate.
-//    iSlotSize: Size of the slot to allocate
+//    iSlotSize: Unused, the pool knows the size of its slots.
 //  OUT
 //    None
 //
@@ -290,7 +545,7 @@ MemPool::Private::Pool::~Pool()
 //    true if the allocated memory is in the slab , false otherwise.
 //
 ////////////////////////////////////////////////////////////////////////
-void MemPool::Private::Pool::deallocate(void *pv, std::size_t iSlotSize)
+void MemPool::Private::Pool::deallocate(void *pv, std::size_t /*iSlotSize*/)
 {
 	bool bFound = true;
 	int index = 0;
@@ -311,7 +566,7 @@ void MemPool::Private::Pool::deallocate(void *pv, std::size_t iSlotSize)
 	{
 		if ( lo >= 0 )
 		{
-			bFound = maSlabs.at(lo).deallocate(pv, iSlotSize);
+			bFound = maSlabs.at(lo).deallocate(pv);
 			if ( bFound )
 			{
 				miLastDeallocate = lo;
@@ -321,7 +576,7 @@ void MemPool::Private::Pool::deallocate(void *pv, std::size_t iSlotSize)
 		}
 		if ( hi < highbound)
 		{
-			bFound = maSlabs.at(hi).deallocate(pv, iSlotSize);
+			bFound = maSlabs.at(hi).deallocate(pv);
 			if ( bFound )
 			{
 				miLastDeallocate = hi;
@@ -457,9 +712,6 @@ void MemPool::Private::Pool::shrink()
 
 	int iLastIndex = maSlabs.size() - 1;
 
-	
-		return;
-
 	// Check if this is the last slab and both the last and the second last slab is empty
 	// If the current slab and the last slab are both empty, release the last slab
 	// else if only the current slab is empty , swap it at the end.
@@ -472,9 +724,9 @@ void MemPool::Private::Pool::shrink()
 	{
 		if ( maSlabs[iLastIndex].empty() )
 		{
-			miNumSlots = lastSlab.capacity();
+			miNumSlots = std::max(miNumSlots, lastSlab.capacity());
 
-			lastSlab.destroy();
+			release(lastSlab);
 			
 			maSlabs.pop_back();
 
@@ -491,15 +743,14 @@ void MemPool::Private::Pool::shrink()
 	{
 		int lastIndx = maSlabs.size() - 1;
 
-		miNumSlots = lastSlab.capacity();
+		miNumSlots = std::max(miNumSlots, lastSlab.capacity());
 
-		lastSlab.destroy();
+		release(lastSlab);
 
 		maSlabs.pop_back();
 
-		lastSlab = maSlabs.back();
-
-		std::swap(maSlabs[miLastDeallocate], lastSlab);
+		// Move the now empty slab to the end, it is the next one to go.
+		std::swap(maSlabs[miLastDeallocate], maSlabs.back());
 
 		if ( lastIndx == miLastAllocate )
 			miLastAllocate = -1;
@@ -518,37 +769,29 @@ void MemPool::Private::Pool::shrink()
 }
 
 ////////////////////////////////////////////////////////////////////////
-//
-// FUNCTION NAME: adjust
-//
-// Adjust the slot size in preparation for finding a pool for it.
-// This allows object of similar size to share a pool, rather than having
-// distinct pools.
-//
-// ARGUMENTS AND RETURN INFO:
-//  IN
-//		iSlotSize Actual size of the slot requested.
-//  OUT
-//      	None
-//
-//  RETURN
-//    Suggested size of the slot to use .
-//
+// Allocator class Constructor/Destructor Definitions
 ////////////////////////////////////////////////////////////////////////
-
-std::size_t MemPool::Allocator::adjust(std::size_t iSlotSize)
+MemPool::Allocator::Allocator(std::size_t iNumSlots, bool bBackground):miNumSlots(iNumSlots),
+				   miLastSlotSize(0),mpLastPool(NULL),mpProvisioner(NULL),
+				   mpfnPressureHandler(NULL),mpvPressureContext(NULL),
+				   mStaticSlab(0),miStaticSlotSize(0)
 {
-	int iNewSlotSize = iSlotSize;
+	if ( bBackground )
+		mpProvisioner = new Private::Provisioner(&mBudget);
+}
 
-	// Align objects on multiples of 4 byte boundary
-	// The memory allocator is not optimal for objects less than 4 bytes
-	// (highly unlikely).
-	if ( iSlotSize % 4 != 0 )
-	{
-		iNewSlotSize += (4 - iSlotSize%4);
-	}
+MemPool::Allocator::Allocator(std::size_t iNumSlots, char *pcStaticStorage, std::size_t iStaticSlotSize):
+				   miNumSlots(iNumSlots),miLastSlotSize(0),mpLastPool(NULL),mpProvisioner(NULL),
+				   mpfnPressureHandler(NULL),mpvPressureContext(NULL),
+				   mStaticSlab(iNumSlots),miStaticSlotSize(adjust(iStaticSlotSize))
+{
+	mStaticSlab.attach(pcStaticStorage);
+}
 
-	return iNewSlotSize;
+MemPool::Allocator::~Allocator()
+{
+	// Stop the maintenance thread before the pools go away.
+	delete mpProvisioner;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -570,67 +813,1001 @@ std::size_t MemPool::Allocator::adjust(std::size_t iSlotSize)
 void * MemPool::Allocator::allocate(std::size_t iSlotSize)
 {
 	std::size_t iNewSlotSize  = adjust(iSlotSize);
-	Private::Pool *pool;
-	void *pv = NULL;
 
-	// Check if a pool is there for the size requested.
-	Allocator::PoolMap::iterator iter = maPoolMap.find(iNewSlotSize);
+	// Use the static slab while it lasts.
+	if ( iNewSlotSize == miStaticSlotSize && !mStaticSlab.full() )
+		return mStaticSlab.allocate(iNewSlotSize);
+
+	Private::Pool *pool = findPool(iNewSlotSize);
 
-	// If the pool is present, use it.
-	if ( iter != maPoolMap.end() )
-	{
-		pool = &iter->second;
-	}
 	// Create a new Pool
-	else
-	{
-		iter = maPoolMap.insert(std::pair<std::size_t, Private::Pool>(iNewSlotSize,
-			             MemPool::Private::Pool(miNumSlots, iNewSlotSize))).first;
+	if ( pool == NULL )
+		pool = createPool(iNewSlotSize);
 
-		pool = &iter->second;
-	}
-	pv = pool->allocate(iNewSlotSize);
+	void *pv = pool->allocate(iNewSlotSize);
+
+	if ( mBudget.pressure() )
+		relieve();
 
 	return pv;
 }
 
-////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME: deallocate
-// Deallocate a block of memory.
+// FUNCTION NAME: tryAllocate
+// Allocate a block of memory of size iSlotSize without throwing. Lets
+// callers shed load when the budget of the allocator is exhausted.
 //
 // ARGUMENTS AND RETURN INFO:
 //  IN
-//    pv       : Pointer to slot to deallocate.
 //    iSlotSize: Size of the slot to allocate
 //  OUT
 //    None
 //
 //  RETURN
-//    true if the allocated memory is in the slab , false otherwise.
+//    Allocated memory, or NULL if the hard limit has been reached or
+//    the system is out of memory.
 //
 ////////////////////////////////////////////////////////////////////////
-
-void MemPool::Allocator::deallocate (void *pv, std::size_t iSlotSize)
+void * MemPool::Allocator::tryAllocate(std::size_t iSlotSize)
 {
-	// Find the pool which has the given slot
 	std::size_t iNewSlotSize  = adjust(iSlotSize);
-	MemPool::Private::Pool *pool = NULL;
 
-	Allocator::PoolMap::iterator iter = maPoolMap.find(iNewSlotSize);
+	if ( iNewSlotSize == miStaticSlotSize && !mStaticSlab.full() )
+		return mStaticSlab.allocate(iNewSlotSize);
 
-	// throw exception if the deallocate is called with incorrect Slot size
-	if ( iter == maPoolMap.end() )
-	{
-		// To do
-		return;
-	}
-	else
+	Private::Pool *pool = findPool(iNewSlotSize);
+
+	if ( pool == NULL )
 	{
-		pool = &iter->second;
-		pool->deallocate(pv, iNewSlotSize);
+		try
+		{
+			pool = createPool(iNewSlotSize);
+		}
+		catch (std::bad_alloc &)
+		{
+			return NULL;
+		}
 	}
-}
 
+	void *pv = pool->tryAllocate(iNewSlotSize);
+
+	if ( mBudget.pressure() )
+		relieve();
 
+	return pv;
+}
 
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: createPool
+// Add a pool for slots of the given (adjusted) size.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    iSlotSize: Adjusted size of the slot.
+//  OUT
+//    None
+//
+//  RETURN
+//    The new pool.
+//
+////////////////////////////////////////////////////////////////////////
+MemPool::Private::Pool *MemPool::Allocator::createPool(std::size_t iSlotSize)
+{
+	Allocator::PoolMap::iterator iter = maPoolMap.insert(std::pair<std::size_t, Private::Pool>(iSlotSize,
+		             MemPool::Private::Pool(miNumSlots, iSlotSize, mpProvisioner, &mBudget))).first;
+
+	miLastSlotSize = iSlotSize;
+	mpLastPool = &iter->second;
+
+	return mpLastPool;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: deallocate
+// Deallocate a block of memory.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    pv       : Pointer to slot to deallocate.
+//    iSlotSize: Size of the slot to allocate
+//  OUT
+//    None
+//
+//  RETURN
+//    true if the allocated memory is in the slab , false otherwise.
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Allocator::deallocate (void *pv, std::size_t iSlotSize)
+{
+	// Find the pool which has the given slot
+	std::size_t iNewSlotSize  = adjust(iSlotSize);
+
+	if ( iNewSlotSize == miStaticSlotSize && mStaticSlab.deallocate(pv) )
+		return;
+
+	MemPool::Private::Pool *pool = findPool(iNewSlotSize);
+
+	// throw exception if the deallocate is called with incorrect Slot size
+	if ( pool == NULL )
+	{
+		// To do
+		return;
+	}
+	else
+	{
+		pool->deallocate(pv, iNewSlotSize);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: findPool
+// Find the pool managing slots of the given (adjusted) size. The last
+// pool found is cached, as callers usually request the same size again.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    iSlotSize: Adjusted size of the slot.
+//  OUT
+//    None
+//
+//  RETURN
+//    The pool, or NULL if no pool has been created for that size.
+//
+////////////////////////////////////////////////////////////////////////
+
+MemPool::Private::Pool *MemPool::Allocator::findPool(std::size_t iSlotSize)
+{
+	if ( mpLastPool != NULL && miLastSlotSize == iSlotSize )
+		return mpLastPool;
+
+	Allocator::PoolMap::iterator iter = maPoolMap.find(iSlotSize);
+
+	if ( iter == maPoolMap.end() )
+		return NULL;
+
+	// Map nodes never move, so the pointer stays valid.
+	miLastSlotSize = iSlotSize;
+	mpLastPool = &iter->second;
+
+	return mpLastPool;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: setBudget
+// Set the soft and hard limits on the bytes held in slabs. Slabs
+// already reserved are not released by lowering the limits.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    iSoftLimit: Reservation which triggers the pressure handler and a
+//                trim, 0 for none.
+//    iHardLimit: Reservation which is never exceeded, 0 for none.
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Allocator::setBudget(std::size_t iSoftLimit, std::size_t iHardLimit)
+{
+	mBudget.setLimits(iSoftLimit, iHardLimit);
+}
+
+void MemPool::Allocator::setPressureHandler(PressureHandler pfnHandler, void *pvContext)
+{
+	mpfnPressureHandler = pfnHandler;
+	mpvPressureContext = pvContext;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: trim
+// Release the empty slabs of every pool.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    Number of bytes released.
+//
+////////////////////////////////////////////////////////////////////////
+
+std::size_t MemPool::Allocator::trim()
+{
+	std::size_t iReleased = 0;
+
+	Allocator::PoolMap::iterator iter = maPoolMap.begin();
+	for ( ; iter != maPoolMap.end(); ++iter )
+	{
+		iReleased += iter->second.trim();
+	}
+
+	return iReleased;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: relieve
+// Respond to the soft limit being crossed: let the owner shed memory
+// first, then give back every empty slab.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Allocator::relieve()
+{
+	if ( mpfnPressureHandler != NULL )
+		mpfnPressureHandler(*this, mpvPressureContext);
+
+	trim();
+}
+
+////////////////////////////////////////////////////////////////////////
+// Budget class Definitions
+////////////////////////////////////////////////////////////////////////
+void MemPool::Private::Budget::setLimits(std::size_t iSoftLimit, std::size_t iHardLimit)
+{
+	miSoftLimit = iSoftLimit;
+	miHardLimit = iHardLimit;
+	mbPressure = false;
+}
+
+std::size_t MemPool::Private::Budget::available() const
+{
+	if ( miHardLimit == 0 )
+		return std::numeric_limits<std::size_t>::max();
+
+	std::size_t iReserved = reserved();
+
+	return iReserved < miHardLimit ? miHardLimit - iReserved : 0;
+}
+
+void MemPool::Private::Budget::reserve(std::size_t iBytes)
+{
+	std::size_t iBefore = miReserved.fetch_add(iBytes, std::memory_order_relaxed);
+
+	if ( miSoftLimit != 0 && iBefore < miSoftLimit && iBefore + iBytes >= miSoftLimit )
+		mbPressure = true;
+}
+
+bool MemPool::Private::Budget::pressure()
+{
+	bool bPressure = mbPressure;
+	mbPressure = false;
+	return bPressure;
+}
+
+////////////////////////////////////////////////////////////////////////
+// FrameHeap class Constructor Definition
+////////////////////////////////////////////////////////////////////////
+MemPool::Private::FrameHeap::FrameHeap(std::size_t iNumSlots):maAllocator(iNumSlots),
+				   mpRemoteFree(NULL),miNumRefs(1)
+{
+
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: allocate
+// Allocate a coroutine frame. Must be called on the owning thread.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    iSize: Size of the frame requested by the compiler.
+//  OUT
+//    None
+//
+//  RETURN
+//    Memory for the frame, 16 byte aligned.
+//
+////////////////////////////////////////////////////////////////////////
+
+void *MemPool::Private::FrameHeap::allocate(std::size_t iSize)
+{
+	// Pick up frames that other threads have handed back.
+	if ( mpRemoteFree.load(std::memory_order_relaxed) != NULL )
+		drain();
+
+	// Round to a multiple of the header so that every slot, and hence
+	// every frame, stays 16 byte aligned within the slab.
+	std::size_t iSlotSize = iSize + HEADER_SIZE;
+	iSlotSize = (iSlotSize + HEADER_SIZE - 1) & ~(HEADER_SIZE - 1);
+
+	FrameHeader *pHeader = static_cast<FrameHeader *>(maAllocator.allocate(iSlotSize));
+	pHeader->mpOwner = this;
+	pHeader->miSize = iSlotSize;
+
+	miNumRefs.fetch_add(1, std::memory_order_relaxed);
+
+	return reinterpret_cast<char *>(pHeader) + HEADER_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: deallocate
+// Return a coroutine frame to the heap it was allocated from. May be
+// called on any thread.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    pv    : Frame to deallocate.
+//    pLocal: Heap of the calling thread, NULL if it has none.
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::FrameHeap::deallocate(void *pv, FrameHeap *pLocal)
+{
+	if ( pv == NULL )
+		return;
+
+	FrameHeader *pHeader = reinterpret_cast<FrameHeader *>(static_cast<char *>(pv) - HEADER_SIZE);
+	FrameHeap *pOwner = pHeader->mpOwner;
+
+	// Fast path: freed on the thread that created it.
+	if ( pOwner == pLocal )
+	{
+		pOwner->maAllocator.deallocate(pHeader, pHeader->miSize);
+		pOwner->unreference();
+		return;
+	}
+
+	// Hand the frame back to the owning thread.
+	FrameHeader *pHead = pOwner->mpRemoteFree.load(std::memory_order_relaxed);
+	do
+	{
+		pHeader->mpNext = pHead;
+	}
+	while ( !pOwner->mpRemoteFree.compare_exchange_weak(pHead, pHeader,
+				std::memory_order_release, std::memory_order_relaxed) );
+
+	// If the owner has exited this may be the last frame.
+	pOwner->unreference();
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: drain
+// Return the frames freed by other threads to the allocator.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::FrameHeap::drain()
+{
+	FrameHeader *pHeader = mpRemoteFree.exchange(NULL, std::memory_order_acquire);
+
+	while ( pHeader != NULL )
+	{
+		FrameHeader *pNext = pHeader->mpNext;
+
+		maAllocator.deallocate(pHeader, pHeader->miSize);
+
+		pHeader = pNext;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: release
+// Called when the owning thread exits. The heap is destroyed if no
+// frames are outstanding, otherwise by the free of the last one.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::FrameHeap::release()
+{
+	unreference();
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: unreference
+// Drop a reference held by the owner or by a frame, deleting the heap
+// with the last one. Frames still on the remote list go with it.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::FrameHeap::unreference()
+{
+	if ( miNumRefs.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+		delete this;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Provisioner class Constructor/Destructor Definitions
+////////////////////////////////////////////////////////////////////////
+MemPool::Private::Provisioner::Provisioner(Budget *pBudget):mbStop(false),mpBudget(pBudget),
+				   mThread(&Provisioner::run, this)
+{
+
+}
+
+MemPool::Private::Provisioner::~Provisioner()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mbStop = true;
+	}
+	mWakeup.notify_one();
+	mThread.join();
+
+	// Whatever was not picked up is freed here.
+	std::map<const Pool *, Held>::iterator ready = maReady.begin();
+	for ( ; ready != maReady.end(); ++ready )
+		discard(ready->second.mSlab, ready->second.miSlotSize);
+
+	std::vector<Held>::iterator retired = maRetired.begin();
+	for ( ; retired != maRetired.end(); ++retired )
+		discard(retired->mSlab, retired->miSlotSize);
+
+	// Requests never built still hold their reservation.
+	std::vector<Request>::iterator request = maRequests.begin();
+	for ( ; request != maRequests.end(); ++request )
+	{
+		if ( mpBudget != NULL )
+			mpBudget->unreserve(request->miNumSlots * request->miSlotSize);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: request
+// Queue a slab to be built for a pool. The pool has already reserved
+// its bytes; the provisioner unreserves them if it drops the slab.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    pPool    : Pool the slab is for.
+//    iNumSlots: Number of slots in the slab.
+//    iSlotSize: Size of each slot.
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::Provisioner::request(const Pool *pPool, std::size_t iNumSlots, std::size_t iSlotSize)
+{
+	Request request = { pPool, iNumSlots, iSlotSize };
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		maRequests.push_back(request);
+	}
+	mWakeup.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: take
+// Collect the slab built for a pool, if it is ready.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    pPool: Pool the slab was requested for.
+//  OUT
+//    slab : The initialized slab. Its bytes are now charged to the
+//           pool, which reserved them when it made the request.
+//
+//  RETURN
+//    true if a slab was ready, false otherwise.
+//
+////////////////////////////////////////////////////////////////////////
+
+bool MemPool::Private::Provisioner::take(const Pool *pPool, Slab &slab)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	std::map<const Pool *, Held>::iterator iter = maReady.find(pPool);
+
+	if ( iter == maReady.end() )
+		return false;
+
+	slab = iter->second.mSlab;
+	maReady.erase(iter);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: retire
+// Queue a slab removed from a pool to be destroyed, or destroy it at
+// once if it cannot be queued. Its bytes are unreserved once it has
+// been freed.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    slab     : Slab to destroy.
+//    iSlotSize: Size of its slots.
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::Provisioner::retire(const Slab &slab, std::size_t iSlotSize)
+{
+	Held retired = { slab, iSlotSize };
+
+	try
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		maRetired.push_back(retired);
+	}
+	catch (std::exception &)
+	{
+		// Could not queue it, free it here instead.
+		discard(retired.mSlab, iSlotSize);
+		return;
+	}
+	mWakeup.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: discard
+// Free a slab held by the provisioner and give its bytes back to the
+// budget.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    slab     : Slab to free.
+//    iSlotSize: Size of its slots.
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::Provisioner::discard(Slab &slab, std::size_t iSlotSize)
+{
+	std::size_t iBytes = slab.capacity() * iSlotSize;
+
+	slab.destroy();
+
+	if ( mpBudget != NULL )
+		mpBudget->unreserve(iBytes);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: run
+// Body of the maintenance thread. Slabs are built and destroyed with
+// the lock released, so pools only ever wait for the queue updates.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::Provisioner::run()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	for ( ; ; )
+	{
+		while ( !mbStop && maRequests.empty() && maRetired.empty() )
+			mWakeup.wait(lock);
+
+		if ( mbStop )
+			return;
+
+		std::vector<Request> aRequests;
+		std::vector<Held> aRetired;
+		aRequests.swap(maRequests);
+		aRetired.swap(maRetired);
+
+		lock.unlock();
+
+		std::vector<Held>::iterator retired = aRetired.begin();
+		for ( ; retired != aRetired.end(); ++retired )
+			discard(retired->mSlab, retired->miSlotSize);
+
+		std::vector<Request>::iterator request = aRequests.begin();
+		for ( ; request != aRequests.end(); ++request )
+		{
+			Held ready = { Slab(request->miNumSlots), request->miSlotSize };
+
+			// On failure the pool builds the slab itself and reports the error.
+			try
+			{
+				ready.mSlab.initialize(request->miSlotSize);
+			}
+			catch (std::bad_alloc &)
+			{
+				if ( mpBudget != NULL )
+					mpBudget->unreserve(ready.mSlab.capacity() * request->miSlotSize);
+				continue;
+			}
+
+			std::lock_guard<std::mutex> guard(mMutex);
+			if ( !maReady.insert(std::make_pair(request->mpPool, ready)).second )
+				discard(ready.mSlab, ready.miSlotSize);
+		}
+
+		lock.lock();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// EpochDomain class Constructor Definition
+////////////////////////////////////////////////////////////////////////
+MemPool::Private::EpochDomain::EpochDomain():miEpoch(0),mpRecords(NULL)
+{
+
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: instance
+// The process wide domain. It is never destroyed, so threads exiting
+// after static destruction can still hand over their limbo lists.
+//
+////////////////////////////////////////////////////////////////////////
+
+MemPool::Private::EpochDomain &MemPool::Private::EpochDomain::instance()
+{
+	static EpochDomain *gDomain = new EpochDomain();
+	return *gDomain;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: local
+// Find the record of the calling thread, claiming a free one or adding
+// a new one on first use.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    Record of the calling thread.
+//
+////////////////////////////////////////////////////////////////////////
+
+MemPool::Private::EpochDomain::ThreadRecord *MemPool::Private::EpochDomain::local()
+{
+	static thread_local RecordHandle gHandle;
+
+	if ( gHandle.mpRecord != NULL )
+		return gHandle.mpRecord;
+
+	ThreadRecord *pRecord = mpRecords.load(std::memory_order_acquire);
+	for ( ; pRecord != NULL; pRecord = pRecord->mpNext )
+	{
+		bool bInUse = false;
+		if ( pRecord->mbInUse.compare_exchange_strong(bInUse, true) )
+		{
+			gHandle.mpRecord = pRecord;
+			return pRecord;
+		}
+	}
+
+	pRecord = new ThreadRecord();
+	pRecord->miState.store(0);
+	pRecord->mbInUse.store(true);
+	pRecord->miDepth = 0;
+	pRecord->miSinceCollect = 0;
+
+	ThreadRecord *pHead = mpRecords.load(std::memory_order_relaxed);
+	do
+	{
+		pRecord->mpNext = pHead;
+	}
+	while ( !mpRecords.compare_exchange_weak(pHead, pRecord,
+				std::memory_order_release, std::memory_order_relaxed) );
+
+	gHandle.mpRecord = pRecord;
+	return pRecord;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: ~RecordHandle
+// Runs when a thread exits. Hands what is left in its limbo list to the
+// domain and frees the record for reuse.
+//
+////////////////////////////////////////////////////////////////////////
+
+MemPool::Private::EpochDomain::RecordHandle::~RecordHandle()
+{
+	if ( mpRecord == NULL )
+		return;
+
+	EpochDomain &domain = EpochDomain::instance();
+
+	if ( !mpRecord->maLimbo.empty() )
+	{
+		std::lock_guard<std::mutex> lock(domain.mOrphanMutex);
+		domain.maOrphans.insert(domain.maOrphans.end(), mpRecord->maLimbo.begin(), mpRecord->maLimbo.end());
+		mpRecord->maLimbo.clear();
+	}
+
+	mpRecord->miDepth = 0;
+	mpRecord->miSinceCollect = 0;
+	mpRecord->miState.store(0, std::memory_order_release);
+	mpRecord->mbInUse.store(false, std::memory_order_release);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: enter
+// Pin the current epoch for the calling thread. Calls may nest.
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::EpochDomain::enter()
+{
+	ThreadRecord *pRecord = local();
+
+	if ( pRecord->miDepth++ != 0 )
+		return;
+
+	pRecord->miState.store((miEpoch.load(std::memory_order_relaxed) << 1) | 1);
+
+	// Announce the pin before reading any shared pointer.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: leave
+// Release the pin taken by the matching enter().
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::EpochDomain::leave()
+{
+	ThreadRecord *pRecord = local();
+
+	if ( --pRecord->miDepth == 0 )
+		pRecord->miState.store(0, std::memory_order_release);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: retire
+// Queue an object, already unlinked from any shared structure, to be
+// deleted once no reader can hold a pointer to it.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    pv       : Object to delete.
+//    pfnDelete: Function deleting it with its real type.
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::EpochDomain::retire(void *pv, Deleter pfnDelete)
+{
+	ThreadRecord *pRecord = local();
+
+	Retired retired = { pv, pfnDelete, miEpoch.load() };
+	pRecord->maLimbo.push_back(retired);
+
+	if ( ++pRecord->miSinceCollect >= COLLECT_THRESHOLD )
+		collect();
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: collect
+// Try to advance the epoch, then delete whatever the calling thread has
+// retired that is now safe, along with any safe orphaned objects.
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::EpochDomain::collect()
+{
+	ThreadRecord *pRecord = local();
+
+	pRecord->miSinceCollect = 0;
+
+	// With no reader pinned, two steps make everything retired so far safe.
+	if ( tryAdvance() )
+		tryAdvance();
+
+	uint64_t iEpoch = miEpoch.load();
+
+	reclaim(pRecord->maLimbo, iEpoch);
+
+	// Orphans are rare; don't wait for another thread handling them.
+	LimboList aOrphans;
+	{
+		std::unique_lock<std::mutex> lock(mOrphanMutex, std::try_to_lock);
+		if ( !lock.owns_lock() || maOrphans.empty() )
+			return;
+		aOrphans.swap(maOrphans);
+	}
+
+	// Unlike a thread's own list these are not in epoch order.
+	LimboList aKeep;
+	while ( !aOrphans.empty() )
+	{
+		Retired retired = aOrphans.front();
+		aOrphans.pop_front();
+
+		if ( retired.miEpoch + 2 <= iEpoch )
+			retired.mpfnDelete(retired.mpv);
+		else
+			aKeep.push_back(retired);
+	}
+
+	if ( !aKeep.empty() )
+	{
+		std::lock_guard<std::mutex> lock(mOrphanMutex);
+		maOrphans.insert(maOrphans.end(), aKeep.begin(), aKeep.end());
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: flush
+// Collect until the limbo list of the calling thread is empty. Each
+// pass waits for the readers pinned at the time to leave.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    void. Throws std::logic_error if the calling thread is pinned.
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::EpochDomain::flush()
+{
+	ThreadRecord *pRecord = local();
+
+	// Our own pin would keep the epoch from ever advancing.
+	if ( pRecord->miDepth != 0 )
+		throw std::logic_error("MemPool::flush called inside an EpochGuard");
+
+	for ( ; ; )
+	{
+		collect();
+
+		// Deletes may have retired more objects, so check after collecting.
+		if ( pRecord->maLimbo.empty() )
+			return;
+
+		std::this_thread::yield();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: tryAdvance
+// Move the global epoch on if every pinned thread has observed it.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    true if the epoch was advanced.
+//
+////////////////////////////////////////////////////////////////////////
+
+bool MemPool::Private::EpochDomain::tryAdvance()
+{
+	uint64_t iEpoch = miEpoch.load();
+
+	ThreadRecord *pRecord = mpRecords.load(std::memory_order_acquire);
+	for ( ; pRecord != NULL; pRecord = pRecord->mpNext )
+	{
+		uint64_t iState = pRecord->miState.load();
+
+		if ( (iState & 1) != 0 && (iState >> 1) != iEpoch )
+			return false;
+	}
+
+	return miEpoch.compare_exchange_strong(iEpoch, iEpoch + 1);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: reclaim
+// Delete the objects at the front of a thread's limbo list retired at
+// least two epochs ago. The list is in epoch order.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    limbo : Limbo list of the calling thread.
+//    iEpoch: Current global epoch.
+//  OUT
+//    None
+//
+//  RETURN
+//    void
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::Private::EpochDomain::reclaim(LimboList &limbo, uint64_t iEpoch)
+{
+	// Pop before deleting: a destructor may retire more objects.
+	while ( !limbo.empty() && limbo.front().miEpoch + 2 <= iEpoch )
+	{
+		Retired retired = limbo.front();
+		limbo.pop_front();
+
+		retired.mpfnDelete(retired.mpv);
+	}
+}
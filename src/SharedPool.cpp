@@ -0,0 +1,355 @@
+// SharedPool.cpp : Slot pool in POSIX shared memory.
+//
+
+#include "SharedPool.h"
+#include <new>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+	const uint32_t SHARED_POOL_MAGIC = 0x4d504f4c;   // "MPOL"
+	const uint32_t END_OF_LIST = 0xffffffff;
+
+	// Head of the free list: tag in the high half, slot index in the low half.
+	inline uint64_t makeHead(uint64_t iTag, uint32_t iIndex) { return (iTag << 32) | iIndex; }
+	inline uint32_t headIndex(uint64_t iHead) { return static_cast<uint32_t>(iHead); }
+	inline uint64_t headTag(uint64_t iHead) { return iHead >> 32; }
+
+	void throwError(const char *pcWhat)
+	{
+		throw std::system_error(errno, std::generic_category(), pcWhat);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// Layout of the start of the region. Everything in here is shared by
+// all the processes mapping it, so it must not hold pointers.
+////////////////////////////////////////////////////////////////////////
+struct MemPool::SharedPool::Header
+{
+	std::atomic<uint32_t> miMagic;       /// Set once the region is initialized.
+	uint32_t miSlotSize;
+	uint32_t miNumSlots;
+	std::atomic<uint64_t> miHead;        /// Tagged head of the free list.
+	std::atomic<uint32_t> miNumUsed;
+};
+
+// A lock based atomic would only be locked within one process.
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+			  "SharedPool needs lock free atomics to be shared between processes");
+
+namespace
+{
+	// Keep the slots on their own cache lines.
+	const std::size_t HEADER_SIZE = 64;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: SharedPool
+// Create a shared memory object and lay out its slots.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    pcName   : Name of the shared memory object, e.g. "/feed".
+//    iNumSlots: Number of slots in the region.
+//    iSlotSize: Size of each slot, rounded up to a multiple of 8.
+//  OUT
+//    None
+//
+//  RETURN
+//    None. Throws std::system_error if the object cannot be created.
+//
+////////////////////////////////////////////////////////////////////////
+
+MemPool::SharedPool::SharedPool(const char *pcName, std::size_t iNumSlots, std::size_t iSlotSize)
+				   :mpHeader(NULL),mpcSlots(NULL),miLength(0)
+{
+	static_assert(sizeof(Header) <= HEADER_SIZE, "SharedPool header does not fit");
+
+	// Slots must be able to hold the free list link and keep 8 byte alignment.
+	if ( iSlotSize < sizeof(uint64_t) )
+		iSlotSize = sizeof(uint64_t);
+	iSlotSize = (iSlotSize + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+
+	if ( iNumSlots == 0 || iNumSlots >= END_OF_LIST || iSlotSize > 0xffffffff )
+		throw std::invalid_argument("SharedPool: bad slot count or size");
+
+	int iFd = shm_open(pcName, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if ( iFd == -1 )
+		throwError("shm_open");
+
+	std::size_t iLength = HEADER_SIZE + iNumSlots * iSlotSize;
+
+	if ( ftruncate(iFd, iLength) == -1 )
+	{
+		int iError = errno;
+		close(iFd);
+		shm_unlink(pcName);
+		errno = iError;
+		throwError("ftruncate");
+	}
+
+	try
+	{
+		map(iFd, iLength);
+	}
+	catch (...)
+	{
+		close(iFd);
+		shm_unlink(pcName);
+		throw;
+	}
+	close(iFd);
+
+	// ftruncate zero fills, so only the links need setting.
+	mpHeader->miSlotSize = static_cast<uint32_t>(iSlotSize);
+	mpHeader->miNumSlots = static_cast<uint32_t>(iNumSlots);
+
+	for ( std::size_t index = 0; index < iNumSlots; index++ )
+	{
+		*reinterpret_cast<uint32_t *>(slot(index)) =
+			index + 1 == iNumSlots ? END_OF_LIST : static_cast<uint32_t>(index + 1);
+	}
+
+	mpHeader->miNumUsed.store(0, std::memory_order_relaxed);
+	mpHeader->miHead.store(makeHead(0, 0), std::memory_order_relaxed);
+
+	// Publish the layout to attaching processes.
+	mpHeader->miMagic.store(SHARED_POOL_MAGIC, std::memory_order_release);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: SharedPool
+// Attach to an existing shared memory object.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    pcName: Name the creating process used.
+//  OUT
+//    None
+//
+//  RETURN
+//    None. Throws std::system_error if the object cannot be mapped,
+//    if it has not been initialized yet, or if its layout does not
+//    fit in it.
+//
+////////////////////////////////////////////////////////////////////////
+
+MemPool::SharedPool::SharedPool(const char *pcName):mpHeader(NULL),mpcSlots(NULL),miLength(0)
+{
+	int iFd = shm_open(pcName, O_RDWR, 0);
+	if ( iFd == -1 )
+		throwError("shm_open");
+
+	struct stat info;
+	if ( fstat(iFd, &info) == -1 )
+	{
+		int iError = errno;
+		close(iFd);
+		errno = iError;
+		throwError("fstat");
+	}
+
+	// The creator may not have sized the object yet.
+	if ( static_cast<std::size_t>(info.st_size) < HEADER_SIZE )
+	{
+		close(iFd);
+		errno = EAGAIN;
+		throwError("SharedPool not initialized");
+	}
+
+	try
+	{
+		map(iFd, info.st_size);
+	}
+	catch (...)
+	{
+		close(iFd);
+		throw;
+	}
+	close(iFd);
+
+	if ( mpHeader->miMagic.load(std::memory_order_acquire) != SHARED_POOL_MAGIC )
+	{
+		munmap(mpHeader, miLength);
+		mpHeader = NULL;
+		errno = EAGAIN;
+		throwError("SharedPool not initialized");
+	}
+
+	// Don't trust the header of a truncated or foreign object.
+	std::size_t iSlotSize = mpHeader->miSlotSize;
+	std::size_t iNumSlots = mpHeader->miNumSlots;
+
+	if ( iSlotSize < sizeof(uint64_t) || iSlotSize % sizeof(uint64_t) != 0 || iNumSlots == 0 ||
+		 iNumSlots >= END_OF_LIST || iNumSlots > (miLength - HEADER_SIZE) / iSlotSize )
+	{
+		munmap(mpHeader, miLength);
+		mpHeader = NULL;
+		errno = EINVAL;
+		throwError("SharedPool layout does not fit the object");
+	}
+}
+
+MemPool::SharedPool::~SharedPool()
+{
+	if ( mpHeader != NULL )
+		munmap(mpHeader, miLength);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: map
+// Map the shared memory object into this process.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    iFd    : Descriptor of the shared memory object.
+//    iLength: Size of the object.
+//  OUT
+//    None
+//
+//  RETURN
+//    void. Throws std::system_error if mmap fails.
+//
+////////////////////////////////////////////////////////////////////////
+
+void MemPool::SharedPool::map(int iFd, std::size_t iLength)
+{
+	void *pv = mmap(NULL, iLength, PROT_READ | PROT_WRITE, MAP_SHARED, iFd, 0);
+	if ( pv == MAP_FAILED )
+		throwError("mmap");
+
+	mpHeader = static_cast<Header *>(pv);
+	mpcSlots = static_cast<char *>(pv) + HEADER_SIZE;
+	miLength = iLength;
+}
+
+char *MemPool::SharedPool::slot(uint32_t iIndex) const
+{
+	return mpcSlots + static_cast<std::size_t>(iIndex) * mpHeader->miSlotSize;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: allocate
+// Take a slot off the shared free list. May be called concurrently
+// from any thread of any attached process.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    None
+//  OUT
+//    None
+//
+//  RETURN
+//    Memory for the slot. Throws bad_alloc if every slot is in use.
+//
+////////////////////////////////////////////////////////////////////////
+
+void *MemPool::SharedPool::allocate()
+{
+	uint64_t iHead = mpHeader->miHead.load(std::memory_order_acquire);
+	uint32_t iIndex;
+
+	for ( ; ; )
+	{
+		iIndex = headIndex(iHead);
+		if ( iIndex == END_OF_LIST )
+			throw std::bad_alloc();
+
+		// The link may be stale if another process popped this slot
+		// meanwhile; the tag makes the exchange below fail in that case.
+		uint32_t iNext = reinterpret_cast<std::atomic<uint32_t> *>(slot(iIndex))->load(std::memory_order_relaxed);
+
+		if ( mpHeader->miHead.compare_exchange_weak(iHead, makeHead(headTag(iHead) + 1, iNext),
+					std::memory_order_acq_rel, std::memory_order_acquire) )
+			break;
+	}
+
+	mpHeader->miNumUsed.fetch_add(1, std::memory_order_relaxed);
+
+	return slot(iIndex);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: deallocate
+// Return a slot to the shared free list. The slot may have been
+// allocated by any attached process.
+//
+// ARGUMENTS AND RETURN INFO:
+//  IN
+//    pv: Pointer to the slot, as mapped in this process.
+//  OUT
+//    None
+//
+//  RETURN
+//    true if pv is a slot of the region, false otherwise.
+//
+////////////////////////////////////////////////////////////////////////
+
+bool MemPool::SharedPool::deallocate(void *pv)
+{
+	char *pcSlot = static_cast<char *>(pv);
+
+	if ( pcSlot < mpcSlots || pcSlot >= mpcSlots + capacity() * slotSize() )
+		return false;
+
+	// The link is written at pv, so it must be the start of a slot.
+	if ( (pcSlot - mpcSlots) % slotSize() != 0 )
+		return false;
+
+	uint32_t iIndex = static_cast<uint32_t>((pcSlot - mpcSlots) / slotSize());
+	std::atomic<uint32_t> *pLink = reinterpret_cast<std::atomic<uint32_t> *>(pcSlot);
+
+	uint64_t iHead = mpHeader->miHead.load(std::memory_order_relaxed);
+	do
+	{
+		pLink->store(headIndex(iHead), std::memory_order_relaxed);
+	}
+	while ( !mpHeader->miHead.compare_exchange_weak(iHead, makeHead(headTag(iHead) + 1, iIndex),
+				std::memory_order_release, std::memory_order_relaxed) );
+
+	mpHeader->miNumUsed.fetch_sub(1, std::memory_order_relaxed);
+
+	return true;
+}
+
+std::size_t MemPool::SharedPool::offset(const void *pv) const
+{
+	return static_cast<const char *>(pv) - reinterpret_cast<const char *>(mpHeader);
+}
+
+void *MemPool::SharedPool::address(std::size_t iOffset) const
+{
+	return reinterpret_cast<char *>(mpHeader) + iOffset;
+}
+
+std::size_t MemPool::SharedPool::slotSize() const
+{
+	return mpHeader->miSlotSize;
+}
+
+std::size_t MemPool::SharedPool::capacity() const
+{
+	return mpHeader->miNumSlots;
+}
+
+std::size_t MemPool::SharedPool::size() const
+{
+	return mpHeader->miNumUsed.load(std::memory_order_relaxed);
+}
+
+void MemPool::SharedPool::unlink(const char *pcName)
+{
+	shm_unlink(pcName);
+}